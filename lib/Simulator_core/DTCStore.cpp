@@ -0,0 +1,123 @@
+#include "DTCStore.h"
+
+DTCStore::DTCStore() {
+  clearAll();
+}
+
+bool DTCStore::set(uint16_t code, DTCState state) {
+  uint32_t& word = bits[state][code >> 5];
+  uint32_t mask = 1UL << (code & 31);
+  if (word & mask) return false;
+
+  word |= mask;
+  summary[state][code >> 10] |= 1UL << ((code >> 5) & 31);
+  counts[state]++;
+  return true;
+}
+
+bool DTCStore::clear(uint16_t code, DTCState state) {
+  uint32_t& word = bits[state][code >> 5];
+  uint32_t mask = 1UL << (code & 31);
+  if (!(word & mask)) return false;
+
+  word &= ~mask;
+  if (word == 0) {
+    summary[state][code >> 10] &= ~(1UL << ((code >> 5) & 31));
+  }
+  counts[state]--;
+  return true;
+}
+
+bool DTCStore::confirm(uint16_t code, const SimulatedData& snapshot) {
+  clear(code, DTC_PENDING);
+  bool added = set(code, DTC_STORED);
+  set(code, DTC_PERMANENT);
+
+  if (!frozen.valid) {
+    frozen.valid = true;
+    frozen.dtc = code;
+    frozen.data = snapshot;
+  }
+  return added;
+}
+
+uint16_t DTCStore::nextFree(uint16_t from, DTCState state) const {
+  int wordIndex = from >> 5;
+  uint32_t used = bits[state][wordIndex] | ((1UL << (from & 31)) - 1);
+
+  // At most one extra pass over the start word after wrapping
+  for (int visited = 0; visited <= DTC_WORDS; visited++) {
+    if (wordIndex == 0) used |= 1UL;  // Skip 0000
+    if (used != UINT32_MAX) {
+      return (wordIndex << 5) | __builtin_ctz(~used);
+    }
+    wordIndex = (wordIndex + 1) % DTC_WORDS;
+    used = bits[state][wordIndex];
+  }
+  return from;
+}
+
+void DTCStore::clearState(DTCState state) {
+  memset(bits[state], 0, sizeof(bits[state]));
+  memset(summary[state], 0, sizeof(summary[state]));
+  counts[state] = 0;
+}
+
+void DTCStore::clearDiagnostics() {
+  clearState(DTC_PENDING);
+  clearState(DTC_STORED);
+  frozen = FreezeFrame();
+}
+
+void DTCStore::clearAll() {
+  for (int state = 0; state < DTC_STATE_COUNT; state++) {
+    clearState((DTCState)state);
+  }
+  frozen = FreezeFrame();
+}
+
+uint16_t DTCStore::list(DTCState state, uint16_t* out, uint16_t maxCodes) const {
+  uint16_t written = 0;
+
+  // Visit only non-empty words via the summary bitmap
+  for (int s = 0; s < DTC_SUMMARY_WORDS && written < maxCodes; s++) {
+    uint32_t pending = summary[state][s];
+    while (pending != 0 && written < maxCodes) {
+      int wordIndex = (s << 5) | __builtin_ctz(pending);
+      pending &= pending - 1;
+
+      uint32_t word = bits[state][wordIndex];
+      while (word != 0 && written < maxCodes) {
+        out[written++] = (wordIndex << 5) | __builtin_ctz(word);
+        word &= word - 1;
+      }
+    }
+  }
+
+  return written;
+}
+
+bool DTCStore::parseCode(const String& text, uint16_t& code) {
+  static const char systems[] = "PCBU";
+  if (text.length() != 5) return false;
+
+  const char* system = strchr(systems, toupper(text.charAt(0)));
+  if (system == nullptr || *system == '\0') return false;
+
+  // Exactly four hex digits (strtol alone would accept "0X12", signs, ...)
+  for (int i = 1; i < 5; i++) {
+    if (!isxdigit(text.charAt(i))) return false;
+  }
+  long number = strtol(text.c_str() + 1, nullptr, 16);
+  if (number > 0x3FFF) return false;
+
+  code = ((system - systems) << 14) | number;
+  return code != 0;
+}
+
+String DTCStore::formatCode(uint16_t code) {
+  static const char systems[] = "PCBU";
+  char text[6];
+  snprintf(text, sizeof(text), "%c%04X", systems[code >> 14], code & 0x3FFF);
+  return String(text);
+}
@@ -0,0 +1,72 @@
+#ifndef DTC_STORE_H
+#define DTC_STORE_H
+
+#include <Arduino.h>
+#include "SimulatedData.h"
+
+// Full P/C/B/U code space: 2-bit system + 14-bit code (same as the 2 bytes on the wire)
+#define DTC_CODE_SPACE          65536
+#define DTC_WORDS               (DTC_CODE_SPACE / 32)
+#define DTC_SUMMARY_WORDS       (DTC_WORDS / 32)
+#define MAX_DTCS_PER_RESPONSE   255
+
+// DTC states (Mode 07 / Mode 03 / Mode 0A)
+enum DTCState : uint8_t {
+  DTC_PENDING = 0,
+  DTC_STORED,
+  DTC_PERMANENT,
+  DTC_STATE_COUNT
+};
+
+// Snapshot captured when the first stored DTC is set (Mode 02, frame 0)
+struct FreezeFrame {
+  bool valid = false;
+  uint16_t dtc = 0;
+  SimulatedData data;
+};
+
+// Bitset-backed DTC store with O(1) set/test/count and clears independent
+// of the number of stored codes
+class DTCStore {
+public:
+  DTCStore();
+
+  // Single-code operations
+  bool set(uint16_t code, DTCState state);
+  bool clear(uint16_t code, DTCState state);
+  bool has(uint16_t code, DTCState state) const {
+    return bits[state][code >> 5] & (1UL << (code & 31));
+  }
+  uint32_t count(DTCState state) const { return counts[state]; }
+
+  // First code >= from (wrapping, never 0000) not set in the state; the state
+  // must have a free code. Full 32-code words are skipped without testing bits.
+  uint16_t nextFree(uint16_t from, DTCState state) const;
+
+  // Confirm a fault: stored + permanent, no longer pending, freeze frame if none yet.
+  // Returns true if the code was not stored before.
+  bool confirm(uint16_t code, const SimulatedData& snapshot);
+
+  // Bulk clears
+  void clearState(DTCState state);
+  void clearDiagnostics();   // Mode 04: stored, pending and freeze frame (permanent codes remain)
+  void clearAll();
+
+  // Ascending list of codes in a state; returns number written
+  uint16_t list(DTCState state, uint16_t* out, uint16_t maxCodes) const;
+
+  // Freeze frame
+  const FreezeFrame& freezeFrame() const { return frozen; }
+
+  // "P0301" <-> 0x0301 (P0000 is rejected: 00 00 is Mode 03 padding)
+  static bool parseCode(const String& text, uint16_t& code);
+  static String formatCode(uint16_t code);
+
+private:
+  uint32_t bits[DTC_STATE_COUNT][DTC_WORDS];
+  uint32_t summary[DTC_STATE_COUNT][DTC_SUMMARY_WORDS];  // Bit set = bits word non-zero
+  uint32_t counts[DTC_STATE_COUNT];  // Up to DTC_CODE_SPACE, so wider than a code
+  FreezeFrame frozen;
+};
+
+#endif // DTC_STORE_H
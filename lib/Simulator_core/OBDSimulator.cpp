@@ -1,4 +1,8 @@
 #include "OBDSimulator.h"
+#include <esp_idf_version.h>
+#if CONFIG_PM_ENABLE
+#include <esp_pm.h>
+#endif
 
 // Global instance pointer
 OBDSimulator* g_simulator = nullptr;
@@ -20,6 +24,8 @@ void OBDSimulator::begin() {
   
   printSystemInfo();
   initializeSimulatedData();
+  setupECUNetwork();
+  setupEventLoop();
   setupClassicBT();
   setupBLE();
   
@@ -66,6 +72,15 @@ void OBDSimulator::setupBLE() {
                       );
   pRxCharacteristic->setCallbacks(new MyCallbacks());
 
+  // Create Telemetry Characteristic (binary frames; write rate in Hz to start)
+  pTelemetryCharacteristic = pService->createCharacteristic(
+                               CHARACTERISTIC_UUID_TELEMETRY,
+                               BLECharacteristic::PROPERTY_NOTIFY | BLECharacteristic::PROPERTY_WRITE
+                             );
+  pTelemetryCCCD = new BLE2902();
+  pTelemetryCharacteristic->addDescriptor(pTelemetryCCCD);
+  pTelemetryCharacteristic->setCallbacks(new TelemetryCallbacks());
+
   // Start the service
   pService->start();
 
@@ -79,40 +94,243 @@ void OBDSimulator::setupBLE() {
   Serial.println("✅ BLE ready: " + bleName);
 }
 
+void OBDSimulator::setupECUNetwork() {
+  // ECUs registered by the application before begin() are kept; the
+  // defaults are added alongside them unless disabled with setDefaultECUs(false)
+  if (defaultECUs) {
+    static const uint8_t enginePids[] = {
+      0x01, 0x04, 0x05, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x2F, 0x5C
+    };
+    static const uint8_t transmissionPids[] = { 0x0C, 0x0D };
+    static const uint8_t absPids[] = { 0x0D };
+    
+    // A default whose CAN ID is already taken by a custom ECU is skipped
+    ecuNetwork.addECU("Engine", 0x7E8, &simData, enginePids, sizeof(enginePids), true, &dtcStore);
+    ecuNetwork.addECU("Transmission", 0x7E9, &simData, transmissionPids, sizeof(transmissionPids));
+    ecuNetwork.addECU("ABS", 0x7EA, &simData, absPids, sizeof(absPids));
+  }
+  
+  Serial.println("🚗 Virtual CAN network: " + String(ecuNetwork.count()) + " ECUs");
+  for (int i = 0; i < ecuNetwork.count(); i++) {
+    Serial.println("   🔌 " + formatHex(ecuNetwork.ecu(i).responseId) + " " + ecuNetwork.ecu(i).name);
+  }
+}
+
+void OBDSimulator::setupEventLoop() {
+  // begin() runs from setup(), so this is the task that will call loop()
+  loopTaskHandle = xTaskGetCurrentTaskHandle();
+  bleCommandQueue = xQueueCreate(BLE_COMMAND_QUEUE_DEPTH, sizeof(BLECommand));
+  
+  // Periodic simulation tick replaces polling updateSimulatedData()
+  esp_timer_create_args_t timerArgs = {};
+  timerArgs.callback = &OBDSimulator::simTimerCallback;
+  timerArgs.arg = this;
+  timerArgs.name = "obd_sim";
+  esp_timer_create(&timerArgs, &simTimer);
+  esp_timer_start_periodic(simTimer, SIM_UPDATE_INTERVAL_MS * 1000ULL);
+  
+  // Telemetry timers are created stopped; a client sets the rate
+  setupTelemetryStream(bleTelemetry, EVT_BLE_TELEMETRY, "ble_tlm");
+  setupTelemetryStream(classicTelemetry, EVT_CLASSIC_TELEMETRY, "spp_tlm");
+  
+#if CONFIG_PM_ENABLE && CONFIG_FREERTOS_USE_TICKLESS_IDLE
+  // Allow light sleep while the loop task is blocked (requires PM-enabled sdkconfig)
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+  esp_pm_config_t pmConfig = {};
+#else
+  esp_pm_config_esp32_t pmConfig = {};
+#endif
+  pmConfig.max_freq_mhz = ESP.getCpuFreqMHz();
+  pmConfig.min_freq_mhz = 40;
+  pmConfig.light_sleep_enable = true;
+  if (esp_pm_configure(&pmConfig) == ESP_OK) {
+    Serial.println("💤 Light sleep enabled while idle");
+  }
+#endif
+  
+  loopStats.windowStartUs = micros();
+  Serial.println("⚡ Event-driven loop ready (sim tick: " + String(SIM_UPDATE_INTERVAL_MS) + " ms)");
+}
+
+void OBDSimulator::notifyLoop(uint32_t events) {
+  if (loopTaskHandle != nullptr) {
+    xTaskNotify(loopTaskHandle, events, eSetBits);
+  }
+}
+
+void OBDSimulator::simTimerCallback(void* arg) {
+  static_cast<OBDSimulator*>(arg)->notifyLoop(EVT_SIM_TICK);
+}
+
+void OBDSimulator::setupTelemetryStream(TelemetryStream& stream, uint32_t event, const char* name) {
+  stream.event = event;
+  
+  esp_timer_create_args_t timerArgs = {};
+  timerArgs.callback = &OBDSimulator::telemetryTimerCallback;
+  timerArgs.arg = &stream;
+  timerArgs.name = name;
+  esp_timer_create(&timerArgs, &stream.timer);
+}
+
+void OBDSimulator::telemetryTimerCallback(void* arg) {
+  // Count every tick so ticks merged into one notification still use up
+  // sequence numbers
+  TelemetryStream* stream = static_cast<TelemetryStream*>(arg);
+  __atomic_fetch_add(&stream->pendingTicks, 1, __ATOMIC_RELAXED);
+  g_simulator->notifyLoop(stream->event);
+}
+
+bool OBDSimulator::takeTelemetryTick(TelemetryStream& stream, uint16_t& sequence) {
+  uint32_t ticks = __atomic_exchange_n(&stream.pendingTicks, 0, __ATOMIC_RELAXED);
+  if (ticks == 0) return false;
+  
+  // Skip the sequence numbers of ticks that could not be sent
+  stream.sequence += ticks - 1;
+  sequence = stream.sequence++;
+  return true;
+}
+
+void OBDSimulator::setClassicTelemetryRate(uint16_t hz) {
+  setTelemetryRate(classicTelemetry, hz);
+  classicBinaryMode = classicTelemetry.rateHz > 0;
+}
+
+void OBDSimulator::setTelemetryRate(TelemetryStream& stream, uint16_t hz) {
+  if (stream.timer == nullptr) return;
+  
+  hz = min(hz, (uint16_t)TELEMETRY_MAX_RATE_HZ);
+  esp_timer_stop(stream.timer); // Fails harmlessly if not running
+  stream.rateHz = hz;
+  if (hz > 0) {
+    esp_timer_start_periodic(stream.timer, 1000000ULL / hz);
+  }
+}
+
 void OBDSimulator::loop() {
+  // Sleep until a callback or the simulation timer wakes us; only the
+  // periodic status output needs a timeout
+  TickType_t timeout = portMAX_DELAY;
+  if (debugMode) {
+    unsigned long sinceStatus = millis() - lastDebugOutput;
+    timeout = sinceStatus >= STATUS_INTERVAL_MS ? 0 : pdMS_TO_TICKS(STATUS_INTERVAL_MS - sinceStatus);
+  }
+  
+  uint32_t events = 0;
+  uint32_t waitStart = micros();
+  xTaskNotifyWait(0, UINT32_MAX, &events, timeout);
+  loopStats.idleUs += micros() - waitStart;
+  if (events != 0) loopStats.wakeups++;
+  
   // Update simulated data
-  updateSimulatedData();
+  if (events & EVT_SIM_TICK) {
+    stepSimulation();
+  }
+  
+  // Drop SPP binary mode before serving a client that may have reconnected
+  if (events & EVT_CLASSIC_DISCONNECT) {
+    setClassicTelemetryRate(0);
+  }
   
   // Handle Classic Bluetooth commands
-  if (classicConnected && pSerialBT->available()) {
+  if (events & EVT_CLASSIC_RX) {
+    handleClassicCommand();
+  }
+  
+  // Handle queued BLE commands
+  if (events & EVT_BLE_RX) {
+    BLECommand bleCmd;
+    while (xQueueReceive(bleCommandQueue, &bleCmd, 0) == pdTRUE) {
+      handleBLECommand(bleCmd);
+    }
+  }
+  
+  // Stream binary telemetry
+  if (events & EVT_BLE_TELEMETRY) {
+    sendBLETelemetry();
+  }
+  if (events & EVT_CLASSIC_TELEMETRY) {
+    sendClassicTelemetry();
+  }
+  
+  // Handle BLE connection status changes
+  if (events & EVT_BLE_CONNECTION) {
+    handleBLEConnectionChange();
+  }
+  
+  // Periodic status output
+  if (debugMode && (millis() - lastDebugOutput >= STATUS_INTERVAL_MS)) {
+    printStatus();
+    printLoopStats();
+    lastDebugOutput = millis();
+  }
+}
+
+void OBDSimulator::handleClassicCommand() {
+  // One data event may carry several '\r'-terminated commands
+  while (classicConnected && pSerialBT->available()) {
     String command = pSerialBT->readStringUntil('\r');
     command.trim();
     
-    if (command.length() > 0) {
-      commandCount++;
-      unsigned long timeSinceConnection = millis() - connectionTime;
-      
-      if (debugMode) {
-        Serial.println("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━");
-        Serial.println("📨 CLASSIC BT COMMAND #" + String(commandCount));
-        Serial.println("⏰ Time: +" + String(timeSinceConnection) + " ms");
-        Serial.println("📝 Raw: '" + command + "'");
-      }
-      
-      String response = processOBDCommand(command, "Classic");
+    if (command.length() == 0) continue;
+    
+    commandCount++;
+    unsigned long timeSinceConnection = millis() - connectionTime;
+    
+    if (debugMode) {
+      Serial.println("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━");
+      Serial.println("📨 CLASSIC BT COMMAND #" + String(commandCount));
+      Serial.println("⏰ Time: +" + String(timeSinceConnection) + " ms");
+      Serial.println("📝 Raw: '" + command + "'");
+    }
+    
+    // In binary mode only ATTLM is accepted, and replies are suppressed
+    // while streaming continues so the link carries nothing but frames
+    bool wasBinary = classicBinaryMode;
+    if (wasBinary && !cleanCommand(command).startsWith("ATTLM")) {
+      if (debugMode) Serial.println("🚫 Classic BT in binary telemetry mode, command ignored");
+      continue;
+    }
+    
+    String response = processOBDCommand(command, "Classic");
+    if (!(wasBinary && classicBinaryMode)) {
       sendClassicResponse(command, response);
-      
-      if (debugMode) {
-        Serial.println("🔄 Classic Response: '" + response + "'");
-        Serial.println("✅ Classic Response sent!");
-        Serial.println("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━");
-      }
+    }
+    recordLatency(classicRxUs);
+    
+    if (debugMode) {
+      Serial.println("🔄 Classic Response: '" + response + "'");
+      Serial.println("✅ Classic Response sent!");
+      Serial.println("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━");
     }
   }
+}
+
+void OBDSimulator::handleBLECommand(const BLECommand& bleCmd) {
+  String command = String(bleCmd.text);
   
-  // Handle BLE connection status changes
+  commandCount++;
+  unsigned long timeSinceConnection = millis() - connectionTime;
+  
+  if (debugMode) {
+    Serial.println("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━");
+    Serial.println("📨 BLE COMMAND #" + String(commandCount));
+    Serial.println("⏰ Time: +" + String(timeSinceConnection) + " ms");
+    Serial.println("📝 Raw: '" + command + "'");
+  }
+  
+  String response = processOBDCommand(command, "BLE");
+  sendBLEResponse(response);
+  recordLatency(bleCmd.receivedUs);
+  
+  if (debugMode) {
+    Serial.println("🔄 BLE Response: '" + response + "'");
+    Serial.println("✅ BLE Response sent!");
+    Serial.println("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━");
+  }
+}
+
+void OBDSimulator::handleBLEConnectionChange() {
   if (!deviceConnected && oldDeviceConnected) {
-    delay(500); // Give time for client to disconnect
     pServer->startAdvertising();
     oldDeviceConnected = deviceConnected;
   }
@@ -120,12 +338,14 @@ void OBDSimulator::loop() {
   if (deviceConnected && !oldDeviceConnected) {
     oldDeviceConnected = deviceConnected;
   }
-  
-  // Periodic status output
-  if (debugMode && (millis() - lastDebugOutput > 5000)) {
-    printStatus();
-    lastDebugOutput = millis();
-  }
+}
+
+void OBDSimulator::recordLatency(uint32_t receivedUs) {
+  // Time from the transport callback until the response has been handed to the stack
+  uint32_t latency = micros() - receivedUs;
+  loopStats.responses++;
+  loopStats.totalLatencyUs += latency;
+  if (latency > loopStats.maxLatencyUs) loopStats.maxLatencyUs = latency;
 }
 
 void OBDSimulator::initializeSimulatedData() {
@@ -145,71 +365,71 @@ void OBDSimulator::initializeSimulatedData() {
 }
 
 void OBDSimulator::updateSimulatedData() {
-  if (millis() - lastDataUpdate > 100) { // Update every 100ms
-    // Simulate realistic engine behavior
-    static float targetRPM = simData.rpm;
-    static unsigned long rpmChangeTime = 0;
-    
-    if (millis() - rpmChangeTime > random(3000, 8000)) {
-      targetRPM = random(750, 4000);
-      rpmChangeTime = millis();
-    }
-    
-    // Smooth RPM changes
-    if (simData.rpm < targetRPM) {
-      simData.rpm += random(5, 25);
-    } else if (simData.rpm > targetRPM) {
-      simData.rpm -= random(5, 25);
-    }
-    simData.rpm = constrain(simData.rpm, 700, 6000);
-    
-    // Update other parameters based on RPM
-    simData.speed = map(simData.rpm, 700, 6000, 0, 120) + random(-5, 5);
-    simData.speed = constrain(simData.speed, 0, 150);
-    
-    simData.throttlePos = map(simData.rpm, 700, 6000, 0, 80) + random(-10, 10);
-    simData.throttlePos = constrain(simData.throttlePos, 0, 100);
-    
-    simData.engineLoad = map(simData.rpm, 700, 6000, 15, 85) + random(-5, 5);
-    simData.engineLoad = constrain(simData.engineLoad, 0, 100);
-    
-    simData.airflowRate = map(simData.rpm, 700, 6000, 8, 45) + random(-2, 2);
-    simData.airflowRate = constrain(simData.airflowRate, 5, 50);
-    
-    // Temperature variations
-    simData.coolantTemp += random(-2, 2) * 0.1;
-    simData.coolantTemp = constrain(simData.coolantTemp, 80, 110);
-    
-    simData.oilTemp += random(-2, 2) * 0.1;
-    simData.oilTemp = constrain(simData.oilTemp, 75, 130);
-    
-    // Boost pressure (turbo simulation)
-    if (simData.rpm > 2000 && simData.throttlePos > 50) {
-      simData.boostPressure += random(-3, 8);
-      simData.boostPressure = constrain(simData.boostPressure, 0, 150);
-    } else {
-      simData.boostPressure = max(0.0f, simData.boostPressure - 5);
-    }
-    
-    // Fuel consumption simulation
-    if (simData.engineLoad > 60) {
-      simData.fuelLevel -= 0.001;
-    }
-    simData.fuelLevel = constrain(simData.fuelLevel, 5, 100);
-    
-    lastDataUpdate = millis();
+  if (millis() - lastDataUpdate >= SIM_UPDATE_INTERVAL_MS) {
+    stepSimulation();
   }
 }
 
-String OBDSimulator::processOBDCommand(String cmd, String interface) {
-  String originalCmd = cmd;
+void OBDSimulator::stepSimulation() {
+  // Simulate realistic engine behavior
+  static float targetRPM = simData.rpm;
+  static unsigned long rpmChangeTime = 0;
+  
+  if (millis() - rpmChangeTime > random(3000, 8000)) {
+    targetRPM = random(750, 4000);
+    rpmChangeTime = millis();
+  }
+  
+  // Smooth RPM changes
+  if (simData.rpm < targetRPM) {
+    simData.rpm += random(5, 25);
+  } else if (simData.rpm > targetRPM) {
+    simData.rpm -= random(5, 25);
+  }
+  simData.rpm = constrain(simData.rpm, 700, 6000);
+  
+  // Update other parameters based on RPM
+  simData.speed = map(simData.rpm, 700, 6000, 0, 120) + random(-5, 5);
+  simData.speed = constrain(simData.speed, 0, 150);
+  
+  simData.throttlePos = map(simData.rpm, 700, 6000, 0, 80) + random(-10, 10);
+  simData.throttlePos = constrain(simData.throttlePos, 0, 100);
+  
+  simData.engineLoad = map(simData.rpm, 700, 6000, 15, 85) + random(-5, 5);
+  simData.engineLoad = constrain(simData.engineLoad, 0, 100);
+  
+  simData.airflowRate = map(simData.rpm, 700, 6000, 8, 45) + random(-2, 2);
+  simData.airflowRate = constrain(simData.airflowRate, 5, 50);
+  
+  // Temperature variations
+  simData.coolantTemp += random(-2, 2) * 0.1;
+  simData.coolantTemp = constrain(simData.coolantTemp, 80, 110);
+  
+  simData.oilTemp += random(-2, 2) * 0.1;
+  simData.oilTemp = constrain(simData.oilTemp, 75, 130);
+  
+  // Boost pressure (turbo simulation)
+  if (simData.rpm > 2000 && simData.throttlePos > 50) {
+    simData.boostPressure += random(-3, 8);
+    simData.boostPressure = constrain(simData.boostPressure, 0, 150);
+  } else {
+    simData.boostPressure = max(0.0f, simData.boostPressure - 5);
+  }
+  
+  // Fuel consumption simulation
+  if (simData.engineLoad > 60) {
+    simData.fuelLevel -= 0.001;
+  }
+  simData.fuelLevel = constrain(simData.fuelLevel, 5, 100);
+  
+  lastDataUpdate = millis();
+}
+
+String OBDSimulator::cleanCommand(String cmd) {
   cmd.toUpperCase();
   cmd.trim();
   
-  // Store last command for debugging
-  lastCommand = cmd;
-  
-  // Clean command (remove spaces and non-alphanumeric)
+  // Remove spaces and non-alphanumeric characters
   String cleanCmd = "";
   for (int i = 0; i < cmd.length(); i++) {
     char c = cmd.charAt(i);
@@ -217,23 +437,50 @@ String OBDSimulator::processOBDCommand(String cmd, String interface) {
       cleanCmd += c;
     }
   }
-  cmd = cleanCmd;
+  return cleanCmd;
+}
+
+String OBDSimulator::processOBDCommand(String cmd, String interface) {
+  String originalCmd = cmd;
+  cmd.toUpperCase();
+  cmd.trim();
+  
+  // Store last command for debugging
+  lastCommand = cmd;
+  
+  cmd = cleanCommand(cmd);
   
   if (debugMode) {
     Serial.println("🧹 Cleaned: '" + cmd + "'");
     Serial.println("🔗 Interface: " + interface);
   }
   
+  // Binary telemetry control applies to the interface it arrives on
+  if (cmd.startsWith("ATTLM")) {
+    return processTelemetryCommand(cmd, interface);
+  }
+  
   // Process AT commands
   if (cmd.startsWith("AT")) {
     return processATCommand(cmd);
   }
   
-  // Process OBD2 PIDs
-  if (cmd.length() >= 4) {
-    String mode = cmd.substring(0, 2);
-    String pid = cmd.substring(2, 4);
-    return processOBDPID(mode, pid);
+  // Process OBD2 requests: mode, PID (Modes 01/02/09), frame (Mode 02).
+  // A trailing odd digit (ELM response-count hint) is ignored.
+  if (cmd.length() >= 2) {
+    uint8_t request[3] = {0, 0, 0};
+    int count = min((int)cmd.length() / 2, 3);
+    for (int i = 0; i < count * 2; i++) {
+      if (!isxdigit(cmd.charAt(i))) return "?";
+    }
+    for (int i = 0; i < count; i++) {
+      char hex[3] = { cmd.charAt(i * 2), cmd.charAt(i * 2 + 1), '\0' };
+      request[i] = strtol(hex, nullptr, 16);
+    }
+    
+    bool needsPid = request[0] == 0x01 || request[0] == 0x02 || request[0] == 0x09;
+    if (needsPid && count < 2) return "?";
+    return processOBDPID(request[0], request[1], request[2]);
   }
   
   return "?";
@@ -241,8 +488,9 @@ String OBDSimulator::processOBDCommand(String cmd, String interface) {
 
 String OBDSimulator::processATCommand(String cmd) {
   if (cmd == "ATZ") {
+    // Answer immediately: a blocking reset delay would stall every transport
+    // sharing the event loop, and clients wait for the prompt anyway
     resetELMState();
-    delay(1500); // ELM327 reset delay
     return "ELM327 v1.5";
   }
   else if (cmd == "ATE0") { elmState.echoOn = false; return "OK"; }
@@ -258,6 +506,19 @@ String OBDSimulator::processATCommand(String cmd) {
     if (elmState.protocol == "0") elmState.protocol = "6";
     return "OK";
   }
+  else if (cmd.startsWith("ATDTC")) { return processDTCCommand(cmd); }
+  else if (cmd.startsWith("ATSH")) {
+    // Only 11-bit CAN headers are simulated; 3-byte / 29-bit headers are rejected
+    String header = cmd.substring(4);
+    if (header.length() == 0 || header.length() > 3) return "?";
+    for (unsigned int i = 0; i < header.length(); i++) {
+      if (!isxdigit(header.charAt(i))) return "?";
+    }
+    long id = strtol(header.c_str(), nullptr, 16);
+    if (id >= CAN_ID_SPACE) return "?";
+    elmState.header = id;
+    return "OK";
+  }
   else if (cmd.startsWith("ATST")) {
     elmState.timeout = cmd.substring(4).toInt();
     return "OK";
@@ -275,95 +536,150 @@ String OBDSimulator::processATCommand(String cmd) {
   return "?";
 }
 
-String OBDSimulator::processOBDPID(String mode, String pid) {
-  if (mode == "01") { // Show current data
-    if (pid == "00") {
-      return formatResponse("41 00 BE 1F B8 11");
-    }
-    else if (pid == "05") {
-      // Engine coolant temperature
-      int temp = (int)(simData.coolantTemp + 40);
-      return formatResponse("41 05 " + formatHex(temp));
-    }
-    else if (pid == "0C") {
-      // Engine RPM
-      int rpm = (int)(simData.rpm * 4);
-      int a = (rpm >> 8) & 0xFF;
-      int b = rpm & 0xFF;
-      return formatResponse("41 0C " + formatHex(a) + " " + formatHex(b));
-    }
-    else if (pid == "0D") {
-      // Vehicle speed
-      int speed = (int)simData.speed;
-      return formatResponse("41 0D " + formatHex(speed));
-    }
-    else if (pid == "0E") {
-      // Timing advance
-      int timing = 10 + 128; // 10 degrees + 128 offset
-      return formatResponse("41 0E " + formatHex(timing));
-    }
-    else if (pid == "0F") {
-      // Intake air temperature
-      int temp = 25 + 40; // 25°C + 40 offset
-      return formatResponse("41 0F " + formatHex(temp));
-    }
-    else if (pid == "10") {
-      // Airflow rate
-      int airflow = (int)(simData.airflowRate * 100);
-      int a = (airflow >> 8) & 0xFF;
-      int b = airflow & 0xFF;
-      return formatResponse("41 10 " + formatHex(a) + " " + formatHex(b));
-    }
-    else if (pid == "11") {
-      // Throttle position
-      int throttle = (int)(simData.throttlePos * 2.55);
-      return formatResponse("41 11 " + formatHex(throttle));
-    }
-    else if (pid == "0B") {
-      // Intake manifold absolute pressure
-      int pressure = (int)(simData.boostPressure + 101);
-      pressure = constrain(pressure, 0, 255);
-      return formatResponse("41 0B " + formatHex(pressure));
-    }
-    else if (pid == "04") {
-      // Engine load
-      int load = (int)(simData.engineLoad * 2.55);
-      return formatResponse("41 04 " + formatHex(load));
-    }
-    else if (pid == "2F") {
-      // Fuel level
-      int fuel = (int)(simData.fuelLevel * 2.55);
-      return formatResponse("41 2F " + formatHex(fuel));
-    }
-    else if (pid == "5C") {
-      // Engine oil temperature
-      int temp = (int)(simData.oilTemp + 40);
-      return formatResponse("41 5C " + formatHex(temp));
-    }
-    else if (pid == "20") {
-      return formatResponse("41 20 80 00 00 01");
+String OBDSimulator::processTelemetryCommand(String cmd, String interface) {
+  // ATTLM<hz> starts binary frames at <hz>, ATTLM0 stops them
+  String rate = cmd.substring(5);
+  if (rate.length() == 0 || rate.length() > 3) return "?";
+  for (unsigned int i = 0; i < rate.length(); i++) {
+    if (!isdigit(rate.charAt(i))) return "?";
+  }
+  uint16_t hz = constrain(rate.toInt(), 0, TELEMETRY_MAX_RATE_HZ);
+  if (interface == "BLE") {
+    setBLETelemetryRate(hz);
+  } else {
+    setClassicTelemetryRate(hz);
+  }
+  
+  if (debugMode) {
+    Serial.println("📡 " + interface + " telemetry: " + (hz > 0 ? String(hz) + " Hz" : String("off")));
+  }
+  return "OK";
+}
+
+String OBDSimulator::processDTCCommand(String cmd) {
+  // Simulator extensions for fault injection:
+  //   ATDTCS<code>  store (confirm) a DTC, e.g. ATDTCSP0301
+  //   ATDTCP<code>  set a pending DTC
+  //   ATDTCR<n>     store n random DTCs
+  //   ATDTCC        clear everything, including permanent DTCs
+  char op = cmd.length() > 5 ? cmd.charAt(5) : '\0';
+  String arg = cmd.substring(6);
+  uint16_t code = 0;
+  
+  if (op == 'C' && arg.length() == 0) {
+    dtcStore.clearAll();
+  }
+  else if (op == 'S' && DTCStore::parseCode(arg, code)) {
+    dtcStore.confirm(code, simData);
+  }
+  else if (op == 'P' && DTCStore::parseCode(arg, code)) {
+    dtcStore.set(code, DTC_PENDING);
+  }
+  else if (op == 'R' && arg.length() > 0) {
+    // Random start in 1..65535 (0000 is not a valid code), then the next
+    // code not yet stored, so each insert costs one scan at most
+    long available = (DTC_CODE_SPACE - 1) - (long)dtcStore.count(DTC_STORED);
+    long count = constrain(arg.toInt(), 0, available);
+    for (long added = 0; added < count; added++) {
+      uint16_t code = dtcStore.nextFree(random(1, DTC_CODE_SPACE), DTC_STORED);
+      dtcStore.confirm(code, simData);
     }
-    else if (pid == "40") {
-      return formatResponse("41 40 40 00 00 00");
+  }
+  else {
+    return "?";
+  }
+  
+  if (debugMode) {
+    Serial.println("🚨 DTCs: " + String(dtcStore.count(DTC_STORED)) + " stored, " +
+                   String(dtcStore.count(DTC_PENDING)) + " pending, " +
+                   String(dtcStore.count(DTC_PERMANENT)) + " permanent");
+  }
+  return "OK";
+}
+
+String OBDSimulator::processOBDPID(uint8_t mode, uint8_t pid, uint8_t frame) {
+  // Every ECU that matches the header answers (all of them for functional
+  // 7DF requests)
+  uint64_t responders = ecuNetwork.respondersFor(elmState.header, mode, pid);
+  String response = "";
+  uint8_t payload[MAX_OBD_PAYLOAD];
+  
+  if (mode == 0x04) {
+    ecuNetwork.clearDiagnostics(responders);
+  }
+  
+  while (responders != 0) {
+    int index = __builtin_ctzll(responders);
+    responders &= responders - 1;
+    
+    const VirtualECU& ecu = ecuNetwork.ecu(index);
+    uint16_t len = ecuNetwork.encodeResponse(index, mode, pid, frame, payload);
+    if (len == 0) continue;
+    
+    if (response.length() > 0) {
+      response += lineBreak();
     }
+    response += formatResponse(formatPayload(ecu.responseId, payload, len));
   }
-  else if (mode == "03") { // Show stored DTCs
-    return "43 00"; // No DTCs
+  
+  if (response.length() == 0) return "NO DATA";
+  return response;
+}
+
+String OBDSimulator::formatPayload(uint16_t canId, const uint8_t* payload, uint16_t len) {
+  String text = "";
+  text.reserve(len * 3 + (len / 7 + 1) * 8);
+  String prefix = elmState.headersOn ? formatHex(canId) + " " : String("");
+  
+  // Single frame: PCI length byte is only visible with headers on
+  if (len <= 7) {
+    text += prefix;
+    if (elmState.headersOn) text += formatHex(len) + " ";
+    for (uint16_t i = 0; i < len; i++) {
+      if (i > 0) text += " ";
+      text += formatHex(payload[i]);
+    }
+    return text;
   }
-  else if (mode == "04") { // Clear DTCs
-    return "44";
+  
+  // ISO 15765-2 multi-frame: first frame carries 6 bytes, consecutive frames 7.
+  // Without headers the ELM327 prints the total length, then "n:" line indexes.
+  if (!elmState.headersOn) {
+    String total = formatHex(len);
+    while (total.length() < 3) total = "0" + total;
+    text += total + lineBreak();
   }
-  else if (mode == "09") { // Vehicle information
-    if (pid == "00") {
-      return formatResponse("49 00 54");
+  
+  uint16_t offset = 0;
+  uint8_t sequence = 0;
+  while (offset < len) {
+    uint16_t chunk = sequence == 0 ? 6 : 7;
+    
+    if (offset > 0) text += lineBreak();
+    if (elmState.headersOn) {
+      text += prefix;
+      if (sequence == 0) {
+        text += formatHex(0x10 | (len >> 8)) + " " + formatHex(len & 0xFF) + " ";
+      } else {
+        text += formatHex(0x20 | (sequence & 0x0F)) + " ";
+      }
+    } else {
+      text += "0123456789ABCDEF"[sequence & 0x0F];
+      text += ": ";
     }
-    else if (pid == "02") {
-      // VIN
-      return formatResponse("49 02 01 31 44 34 47 50 30 30 42 35 36 37 35 38 39");
+    
+    for (uint16_t i = 0; i < chunk && offset < len; i++, offset++) {
+      if (i > 0) text += " ";
+      text += formatHex(payload[offset]);
     }
+    sequence++;
   }
   
-  return "NO DATA";
+  return text;
+}
+
+const char* OBDSimulator::lineBreak() const {
+  return elmState.lineFeedsOn ? "\r\n" : "\r";
 }
 
 String OBDSimulator::formatResponse(String response) {
@@ -398,7 +714,6 @@ void OBDSimulator::sendClassicResponse(String cmd, String response) {
   }
   
   pSerialBT->print(fullResponse);
-  delay(elmState.adaptiveTiming ? 50 : 20);
 }
 
 void OBDSimulator::sendBLEResponse(String response) {
@@ -408,10 +723,59 @@ void OBDSimulator::sendBLEResponse(String response) {
       response += "\r\n>";
     }
     
-    pTxCharacteristic->setValue(response.c_str());
-    pTxCharacteristic->notify();
-    delay(20); // Small delay for BLE stability
+    // Split long (multi-frame) responses to fit the negotiated MTU
+    uint16_t mtu = pServer->getPeerMTU(pServer->getConnId());
+    size_t chunk = mtu > 3 ? mtu - 3 : 20;
+    for (size_t offset = 0; offset < response.length(); offset += chunk) {
+      size_t n = min(chunk, (size_t)(response.length() - offset));
+      pTxCharacteristic->setValue((uint8_t*)response.c_str() + offset, n);
+      pTxCharacteristic->notify();
+    }
+  }
+}
+
+void OBDSimulator::buildTelemetryFrame(TelemetryFrame& frame, uint16_t sequence) {
+  frame.magic = TELEMETRY_FRAME_MAGIC;
+  frame.version = TELEMETRY_FRAME_VERSION;
+  frame.sequence = sequence;
+  frame.timestampMs = lastDataUpdate; // Values only change once per simulation step
+  frame.rpm = pidRpm(simData);
+  frame.speed = pidSpeed(simData);
+  frame.engineLoad = pidPercent(simData.engineLoad);
+  frame.throttlePos = pidPercent(simData.throttlePos);
+  frame.fuelLevel = pidPercent(simData.fuelLevel);
+  frame.coolantTemp = pidTemperature(simData.coolantTemp);
+  frame.oilTemp = pidTemperature(simData.oilTemp);
+  frame.intakePressure = pidIntakePressure(simData);
+  frame.airflowRate = pidAirflow(simData);
+  frame.flags = simData.engineRunning ? 0x01 : 0x00;
+}
+
+void OBDSimulator::sendBLETelemetry() {
+  uint16_t sequence;
+  if (!takeTelemetryTick(bleTelemetry, sequence)) return;
+  
+  // Only stream while the client has notifications enabled
+  if (!deviceConnected || pTelemetryCCCD == nullptr || !pTelemetryCCCD->getNotifications()) {
+    return;
   }
+  
+  TelemetryFrame frame;
+  buildTelemetryFrame(frame, sequence);
+  pTelemetryCharacteristic->setValue((uint8_t*)&frame, sizeof(frame));
+  pTelemetryCharacteristic->notify();
+  bleTelemetry.framesSent++;
+}
+
+void OBDSimulator::sendClassicTelemetry() {
+  uint16_t sequence;
+  if (!takeTelemetryTick(classicTelemetry, sequence)) return;
+  if (!classicConnected || !classicBinaryMode) return;
+  
+  TelemetryFrame frame;
+  buildTelemetryFrame(frame, sequence);
+  pSerialBT->write((const uint8_t*)&frame, sizeof(frame));
+  classicTelemetry.framesSent++;
 }
 
 void OBDSimulator::setDeviceName(String classic, String ble) {
@@ -425,6 +789,7 @@ void OBDSimulator::resetELMState() {
   elmState.spacesOn = true;
   elmState.lineFeedsOn = true;
   elmState.protocol = "6";
+  elmState.header = OBD_FUNCTIONAL_ID;
   elmState.adaptiveTiming = true;
   elmState.timeout = 200;
 }
@@ -453,9 +818,37 @@ void OBDSimulator::printStatus() {
   if (bleConnected) connections += "BLE✅ ";
   if (!classicConnected && !bleConnected) connections += "None";
   Serial.println(connections);
+  
+  if (dtcStore.count(DTC_STORED) > 0 || dtcStore.count(DTC_PENDING) > 0 || dtcStore.count(DTC_PERMANENT) > 0) {
+    Serial.println("🚨 DTCs: " + String(dtcStore.count(DTC_STORED)) + " stored, " +
+                   String(dtcStore.count(DTC_PENDING)) + " pending, " +
+                   String(dtcStore.count(DTC_PERMANENT)) + " permanent");
+  }
+  
+  if (bleTelemetry.rateHz > 0 || classicTelemetry.rateHz > 0) {
+    Serial.println("📡 Telemetry: BLE " + String(bleTelemetry.rateHz) + " Hz (" + String(bleTelemetry.framesSent) + " frames), " +
+                   "Classic " + String(classicTelemetry.rateHz) + " Hz (" + String(classicTelemetry.framesSent) + " frames)");
+  }
   Serial.println();
 }
 
+void OBDSimulator::printLoopStats() {
+  uint32_t windowUs = micros() - loopStats.windowStartUs;
+  float idlePercent = windowUs > 0 ? (float)loopStats.idleUs * 100.0f / windowUs : 0.0f;
+  
+  Serial.println("⚡ Event loop:");
+  Serial.println("   💤 Loop task idle: " + String(idlePercent, 1) + "% (" + String(loopStats.wakeups) + " wakeups)");
+  if (loopStats.responses > 0) {
+    uint32_t avgUs = loopStats.totalLatencyUs / loopStats.responses;
+    Serial.println("   ⏱️  Wake-to-response: avg " + String(avgUs) + " us, max " + String(loopStats.maxLatencyUs) + " us (" + String(loopStats.responses) + " cmds)");
+  }
+  Serial.println();
+  
+  uint32_t now = micros();
+  loopStats = LoopStats();
+  loopStats.windowStartUs = now;
+}
+
 // BLE Server Callbacks Implementation
 void MyServerCallbacks::onConnect(BLEServer* pServer) {
   g_simulator->deviceConnected = true;
@@ -476,6 +869,8 @@ void MyServerCallbacks::onConnect(BLEServer* pServer) {
   g_simulator->sendBLEResponse(">");
   Serial.println("📤 BLE: Initial prompt '>' sent");
   Serial.println("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━");
+  
+  g_simulator->notifyLoop(EVT_BLE_CONNECTION);
 }
 
 void MyServerCallbacks::onDisconnect(BLEServer* pServer) {
@@ -489,9 +884,14 @@ void MyServerCallbacks::onDisconnect(BLEServer* pServer) {
   Serial.println("📊 Commands: " + String(g_simulator->commandCount));
   Serial.println("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━");
   
+  // Stop telemetry until the next client subscribes
+  g_simulator->setBLETelemetryRate(0);
+  
   // Restart advertising
   BLEDevice::startAdvertising();
   Serial.println("🔍 BLE advertising restarted");
+  
+  g_simulator->notifyLoop(EVT_BLE_CONNECTION);
 }
 
 // BLE Characteristic Callbacks Implementation
@@ -503,28 +903,35 @@ void MyCallbacks::onWrite(BLECharacteristic *pCharacteristic) {
     rxValue.trim();
     
     if (rxValue.length() > 0) {
-      g_simulator->commandCount++;
-      unsigned long timeSinceConnection = millis() - g_simulator->connectionTime;
-      
-      if (g_simulator->debugMode) {
-        Serial.println("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━");
-        Serial.println("📨 BLE COMMAND #" + String(g_simulator->commandCount));
-        Serial.println("⏰ Time: +" + String(timeSinceConnection) + " ms");
-        Serial.println("📝 Raw: '" + rxValue + "'");
-      }
-      
-      String response = g_simulator->processOBDCommand(rxValue, "BLE");
-      g_simulator->sendBLEResponse(response);
+      // Hand the command to the main loop instead of processing on the BLE task
+      BLECommand bleCmd;
+      strncpy(bleCmd.text, rxValue.c_str(), BLE_COMMAND_MAX_LEN - 1);
+      bleCmd.text[BLE_COMMAND_MAX_LEN - 1] = '\0';
+      bleCmd.receivedUs = micros();
       
-      if (g_simulator->debugMode) {
-        Serial.println("🔄 BLE Response: '" + response + "'");
-        Serial.println("✅ BLE Response sent!");
-        Serial.println("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━");
+      if (xQueueSend(g_simulator->bleCommandQueue, &bleCmd, 0) != pdTRUE) {
+        Serial.println("⚠️ BLE command queue full, dropping: '" + rxValue + "'");
+        return;
       }
+      g_simulator->notifyLoop(EVT_BLE_RX);
     }
   }
 }
 
+// BLE Telemetry Callbacks Implementation
+void TelemetryCallbacks::onWrite(BLECharacteristic *pCharacteristic) {
+  // Rate in Hz: one byte, or uint16 little-endian
+  uint8_t* data = pCharacteristic->getData();
+  size_t length = pCharacteristic->getLength();
+  if (length == 0) return;
+  
+  uint16_t hz = data[0];
+  if (length >= 2) hz |= data[1] << 8;
+  g_simulator->setBLETelemetryRate(hz);
+  
+  Serial.println("📡 BLE telemetry: " + (g_simulator->bleTelemetry.rateHz > 0 ? String(g_simulator->bleTelemetry.rateHz) + " Hz" : String("off")));
+}
+
 // Classic Bluetooth Callback Implementation
 void btClassicCallbackFunction(esp_spp_cb_event_t event, esp_spp_cb_param_t *param) {
   switch (event) {
@@ -557,9 +964,17 @@ void btClassicCallbackFunction(esp_spp_cb_event_t event, esp_spp_cb_param_t *par
         Serial.println("📊 Commands: " + String(g_simulator->commandCount));
         Serial.println("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━");
         g_simulator->classicConnected = false;
+        // Telemetry state belongs to the loop task; stop the stream there
+        g_simulator->notifyLoop(EVT_CLASSIC_DISCONNECT);
       }
       break;
       
+    case ESP_SPP_DATA_IND_EVT:
+      // Data is already queued by BluetoothSerial; wake the main loop
+      g_simulator->classicRxUs = micros();
+      g_simulator->notifyLoop(EVT_CLASSIC_RX);
+      break;
+      
     default:
       break;
   }
@@ -7,24 +7,71 @@
 #include <BLEServer.h>
 #include <BLEUtils.h>
 #include <BLE2902.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include "SimulatedData.h"
+#include "DTCStore.h"
+#include "VirtualECU.h"
+#include "PIDScaling.h"
 
 // BLE UUIDs (Nordic UART Service compatible)
 #define SERVICE_UUID           "6E400001-B5A3-F393-E0A9-E50E24DCCA9E"
 #define CHARACTERISTIC_UUID_RX "6E400002-B5A3-F393-E0A9-E50E24DCCA9E"
 #define CHARACTERISTIC_UUID_TX "6E400003-B5A3-F393-E0A9-E50E24DCCA9E"
+#define CHARACTERISTIC_UUID_TELEMETRY "6E400004-B5A3-F393-E0A9-E50E24DCCA9E"
 
-// Simulation data structure
-struct SimulatedData {
-  float rpm = 800.0;
-  float speed = 0.0;
-  float coolantTemp = 90.0;
-  float oilTemp = 85.0;
-  float fuelLevel = 75.0;
-  float throttlePos = 0.0;
-  float boostPressure = 0.0;
-  float airflowRate = 15.0;
-  int engineLoad = 25;
-  bool engineRunning = true;
+// Binary telemetry stream
+#define TELEMETRY_FRAME_MAGIC   0xA5
+#define TELEMETRY_FRAME_VERSION 1
+#define TELEMETRY_MAX_RATE_HZ   100
+
+// Event loop timing
+#define SIM_UPDATE_INTERVAL_MS 100
+#define STATUS_INTERVAL_MS     5000
+
+// BLE command queue (filled by the BLE callback, drained by the main loop)
+#define BLE_COMMAND_MAX_LEN     64
+#define BLE_COMMAND_QUEUE_DEPTH 8
+
+// Event bits delivered to the main loop task via task notifications
+#define EVT_CLASSIC_RX         (1UL << 0)
+#define EVT_BLE_RX             (1UL << 1)
+#define EVT_BLE_CONNECTION     (1UL << 2)
+#define EVT_SIM_TICK           (1UL << 3)
+#define EVT_BLE_TELEMETRY      (1UL << 4)
+#define EVT_CLASSIC_TELEMETRY  (1UL << 5)
+#define EVT_CLASSIC_DISCONNECT (1UL << 6)
+
+// Binary telemetry frame (little-endian, fits a default 20-byte BLE notification).
+// Each value uses the scaling of its Mode 01 PID (see PIDScaling.h).
+struct __attribute__((packed)) TelemetryFrame {
+  uint8_t magic;          // TELEMETRY_FRAME_MAGIC
+  uint8_t version;        // TELEMETRY_FRAME_VERSION
+  uint16_t sequence;      // Per-stream timer tick, wraps at 65535; gaps = dropped ticks
+  uint32_t timestampMs;   // millis() of the simulation step that produced the values
+  uint16_t rpm;           // PID 0C: rpm * 4
+  uint8_t speed;          // PID 0D: km/h
+  uint8_t engineLoad;     // PID 04: % * 2.55
+  uint8_t throttlePos;    // PID 11: % * 2.55
+  uint8_t fuelLevel;      // PID 2F: % * 2.55
+  uint8_t coolantTemp;    // PID 05: °C + 40
+  uint8_t oilTemp;        // PID 5C: °C + 40
+  uint8_t intakePressure; // PID 0B: kPa
+  uint16_t airflowRate;   // PID 10: g/s * 100
+  uint8_t flags;          // Bit 0: engine running
+};
+static_assert(sizeof(TelemetryFrame) == 20, "TelemetryFrame layout changed");
+
+// Periodic telemetry stream for one transport
+struct TelemetryStream {
+  esp_timer_handle_t timer = nullptr;
+  uint32_t event = 0;
+  uint16_t rateHz = 0;
+  uint16_t sequence = 0;
+  uint32_t framesSent = 0;
+  volatile uint32_t pendingTicks = 0;  // Timer ticks not yet consumed by the loop
 };
 
 // ELM327 state structure
@@ -34,10 +81,27 @@ struct ELMState {
   bool spacesOn = true;
   bool lineFeedsOn = true;
   String protocol = "6";
+  uint16_t header = OBD_FUNCTIONAL_ID;
   bool adaptiveTiming = true;
   int timeout = 200;
 };
 
+// Command queued by the BLE callback for the main loop
+struct BLECommand {
+  char text[BLE_COMMAND_MAX_LEN];
+  uint32_t receivedUs;
+};
+
+// Wake-to-response latency and loop idle time statistics
+struct LoopStats {
+  uint32_t responses = 0;
+  uint64_t totalLatencyUs = 0;
+  uint32_t maxLatencyUs = 0;
+  uint64_t idleUs = 0;
+  uint32_t windowStartUs = 0;
+  uint32_t wakeups = 0;
+};
+
 // Main OBD Simulator class
 class OBDSimulator {
 public:
@@ -48,8 +112,9 @@ public:
   void begin();
   void setupClassicBT();
   void setupBLE();
+  void setupECUNetwork();
   
-  // Main loop processing
+  // Main loop processing (blocks until an event arrives)
   void loop();
   
   // Data management
@@ -59,23 +124,34 @@ public:
   // Command processing
   String processOBDCommand(String cmd, String interface);
   String processATCommand(String cmd);
-  String processOBDPID(String mode, String pid);
+  String processOBDPID(uint8_t mode, uint8_t pid, uint8_t frame = 0);
+  String processDTCCommand(String cmd);
   
   // Response handling
   void sendClassicResponse(String cmd, String response);
   void sendBLEResponse(String response);
   
+  // Binary telemetry
+  void buildTelemetryFrame(TelemetryFrame& frame, uint16_t sequence);
+  void setBLETelemetryRate(uint16_t hz) { setTelemetryRate(bleTelemetry, hz); }
+  void setClassicTelemetryRate(uint16_t hz);
+  
   // Utility functions
   String formatResponse(String response);
   String formatHex(int value);
+  String formatPayload(uint16_t canId, const uint8_t* payload, uint16_t len);
   
   // Status getters
   bool isClassicConnected() const { return classicConnected; }
   bool isBLEConnected() const { return bleConnected; }
   SimulatedData getCurrentData() const { return simData; }
+  const SimulatedData* getDataSource() const { return &simData; }
+  ECUNetwork& getECUNetwork() { return ecuNetwork; }
+  DTCStore& getDTCStore() { return dtcStore; }
   
   // Configuration
   void setDebugMode(bool enabled) { debugMode = enabled; }
+  void setDefaultECUs(bool enabled) { defaultECUs = enabled; }
   void setDeviceName(String classic, String ble);
   
 private:
@@ -85,6 +161,16 @@ private:
   bool deviceConnected = false;
   bool oldDeviceConnected = false;
   
+  // Event loop
+  TaskHandle_t loopTaskHandle = nullptr;
+  QueueHandle_t bleCommandQueue = nullptr;
+  esp_timer_handle_t simTimer = nullptr;
+  volatile uint32_t classicRxUs = 0;
+  LoopStats loopStats;
+  TelemetryStream bleTelemetry;
+  TelemetryStream classicTelemetry;
+  bool classicBinaryMode = false;      // SPP carries only telemetry frames while streaming
+  
   // Timing
   unsigned long lastDataUpdate = 0;
   unsigned long connectionTime = 0;
@@ -94,10 +180,13 @@ private:
   // Data structures
   SimulatedData simData;
   ELMState elmState;
+  ECUNetwork ecuNetwork;
+  DTCStore dtcStore;
   String lastCommand = "";
   
   // Settings
   bool debugMode = true;
+  bool defaultECUs = true;
   String classicBTName = "OBD2_Simulator_Dual";
   String bleName = "OBD2_Simulator_BLE";
   
@@ -108,15 +197,36 @@ private:
   BLEServer* pServer = nullptr;
   BLECharacteristic* pTxCharacteristic = nullptr;
   BLECharacteristic* pRxCharacteristic = nullptr;
+  BLECharacteristic* pTelemetryCharacteristic = nullptr;
+  BLE2902* pTelemetryCCCD = nullptr;
   
   // Private methods
   void printSystemInfo();
   void printStatus();
   void resetELMState();
+  const char* lineBreak() const;
+  void setupEventLoop();
+  void notifyLoop(uint32_t events);
+  void stepSimulation();
+  void handleClassicCommand();
+  void handleBLECommand(const BLECommand& bleCmd);
+  void handleBLEConnectionChange();
+  void recordLatency(uint32_t receivedUs);
+  void printLoopStats();
+  static void simTimerCallback(void* arg);
+  void setupTelemetryStream(TelemetryStream& stream, uint32_t event, const char* name);
+  void setTelemetryRate(TelemetryStream& stream, uint16_t hz);
+  String processTelemetryCommand(String cmd, String interface);
+  bool takeTelemetryTick(TelemetryStream& stream, uint16_t& sequence);
+  String cleanCommand(String cmd);
+  void sendBLETelemetry();
+  void sendClassicTelemetry();
+  static void telemetryTimerCallback(void* arg);
   
   // Friend classes for callbacks
   friend class MyServerCallbacks;
   friend class MyCallbacks;
+  friend class TelemetryCallbacks;
   friend void btClassicCallbackFunction(esp_spp_cb_event_t event, esp_spp_cb_param_t *param);
 };
 
@@ -136,6 +246,12 @@ public:
   void onWrite(BLECharacteristic *pCharacteristic) override;
 };
 
+// BLE Telemetry Characteristic Callbacks (write sets the stream rate in Hz)
+class TelemetryCallbacks: public BLECharacteristicCallbacks {
+public:
+  void onWrite(BLECharacteristic *pCharacteristic) override;
+};
+
 // Classic Bluetooth callback function
 void btClassicCallbackFunction(esp_spp_cb_event_t event, esp_spp_cb_param_t *param);
 
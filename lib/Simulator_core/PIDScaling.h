@@ -0,0 +1,30 @@
+#ifndef PID_SCALING_H
+#define PID_SCALING_H
+
+#include <Arduino.h>
+#include "SimulatedData.h"
+
+// Mode 01 PID encodings (SAE J1979), shared by the ELM responses and the
+// binary telemetry frame so both always agree
+
+// PID 04 / 11 / 2F: percentage as A * 100 / 255
+inline uint8_t pidPercent(float percent) { return (uint8_t)(percent * 2.55); }
+
+// PID 05 / 0F / 5C: temperature as A - 40
+inline uint8_t pidTemperature(float celsius) { return (uint8_t)(celsius + 40); }
+
+// PID 0B: intake manifold absolute pressure in kPa
+inline uint8_t pidIntakePressure(const SimulatedData& d) {
+  return (uint8_t)constrain((int)(d.boostPressure + 101), 0, 255);
+}
+
+// PID 0C: engine RPM as (256A + B) / 4
+inline uint16_t pidRpm(const SimulatedData& d) { return (uint16_t)(d.rpm * 4); }
+
+// PID 0D: vehicle speed in km/h
+inline uint8_t pidSpeed(const SimulatedData& d) { return (uint8_t)d.speed; }
+
+// PID 10: MAF airflow as (256A + B) / 100 g/s
+inline uint16_t pidAirflow(const SimulatedData& d) { return (uint16_t)(d.airflowRate * 100); }
+
+#endif // PID_SCALING_H
@@ -0,0 +1,18 @@
+#ifndef SIMULATED_DATA_H
+#define SIMULATED_DATA_H
+
+// Simulation data structure
+struct SimulatedData {
+  float rpm = 800.0;
+  float speed = 0.0;
+  float coolantTemp = 90.0;
+  float oilTemp = 85.0;
+  float fuelLevel = 75.0;
+  float throttlePos = 0.0;
+  float boostPressure = 0.0;
+  float airflowRate = 15.0;
+  int engineLoad = 25;
+  bool engineRunning = true;
+};
+
+#endif // SIMULATED_DATA_H
@@ -0,0 +1,247 @@
+#include "VirtualECU.h"
+#include "PIDScaling.h"
+
+ECUNetwork::ECUNetwork() {
+  clear();
+}
+
+void ECUNetwork::clear() {
+  ecuCount = 0;
+  mode09Responders = 0;
+  dtcResponders = 0;
+  memset(mode01Responders, 0, sizeof(mode01Responders));
+  memset(ecuByRequestId, -1, sizeof(ecuByRequestId));
+}
+
+int ECUNetwork::addECU(const char* name, uint16_t responseId, const SimulatedData* data,
+                       const uint8_t* pids, size_t pidCount, bool vehicleInfo,
+                       DTCStore* dtcs) {
+  if (ecuCount >= MAX_VIRTUAL_ECUS) return -1;
+  if (responseId < OBD_REQUEST_OFFSET || responseId >= CAN_ID_SPACE) return -1;
+  if (responseId - OBD_REQUEST_OFFSET == OBD_FUNCTIONAL_ID) return -1;
+  if (ecuByRequestId[responseId - OBD_REQUEST_OFFSET] >= 0) return -1;
+
+  int index = ecuCount++;
+  VirtualECU& ecu = ecus[index];
+  ecu = VirtualECU();
+  ecu.name = name;
+  ecu.responseId = responseId;
+  ecu.vehicleInfo = vehicleInfo;
+  ecu.data = data;
+  ecu.dtcs = dtcs;
+
+  // PID 00 is mandatory; each "supported PIDs" range PID (20, 40, ...) is
+  // implied when any PID above it is supported
+  ecu.mode01Pids[0] |= 1UL;
+  for (size_t i = 0; i < pidCount; i++) {
+    uint8_t pid = pids[i];
+    ecu.mode01Pids[pid >> 5] |= 1UL << (pid & 31);
+    for (int base = 0x20; base < pid; base += 0x20) {
+      ecu.mode01Pids[base >> 5] |= 1UL;
+    }
+  }
+
+  // Update lookup tables
+  uint64_t bit = 1ULL << index;
+  for (int pid = 0; pid < 256; pid++) {
+    if (ecu.supportsPID(pid)) mode01Responders[pid] |= bit;
+  }
+  if (vehicleInfo) mode09Responders |= bit;
+  if (dtcs != nullptr) dtcResponders |= bit;
+  ecuByRequestId[ecu.requestId()] = index;
+
+  return index;
+}
+
+uint64_t ECUNetwork::respondersFor(uint16_t header, uint8_t mode, uint8_t pid) const {
+  uint64_t mask = 0;
+  switch (mode) {
+    case 0x01: mask = mode01Responders[pid]; break;
+    case 0x09: mask = mode09Responders; break;
+    case 0x02:
+    case 0x03:
+    case 0x04:
+    case 0x07:
+    case 0x0A: mask = dtcResponders; break;
+  }
+
+  // Physical addressing: only the ECU listening on this request ID answers
+  if (header != OBD_FUNCTIONAL_ID) {
+    int8_t index = header < CAN_ID_SPACE ? ecuByRequestId[header] : -1;
+    mask = index >= 0 ? (mask & (1ULL << index)) : 0;
+  }
+
+  return mask;
+}
+
+uint16_t ECUNetwork::encodeResponse(int index, uint8_t mode, uint8_t pid, uint8_t frame, uint8_t* out) const {
+  const VirtualECU& ecu = ecus[index];
+  out[0] = mode + 0x40;
+
+  // DTC modes carry no PID in the response
+  if (ecu.dtcs != nullptr) {
+    switch (mode) {
+      case 0x03: return encodeDTCList(ecu, DTC_STORED, out);
+      case 0x04: return 1;
+      case 0x07: return encodeDTCList(ecu, DTC_PENDING, out);
+      case 0x0A: return encodeDTCList(ecu, DTC_PERMANENT, out);
+    }
+  }
+
+  uint8_t len = 0;
+  if (mode == 0x01 && ecu.data != nullptr) {
+    len = encodeMode01(ecu, *ecu.data, pid, out + 2);
+  } else if (mode == 0x02 && ecu.dtcs != nullptr) {
+    len = encodeMode02(ecu, pid, frame, out + 2);
+  } else if (mode == 0x09 && ecu.vehicleInfo) {
+    len = encodeMode09(pid, out + 2);
+  }
+  if (len == 0) return 0;
+
+  out[1] = pid;
+  return len + 2;
+}
+
+void ECUNetwork::clearDiagnostics(uint64_t responders) {
+  while (responders != 0) {
+    int index = __builtin_ctzll(responders);
+    responders &= responders - 1;
+    if (ecus[index].dtcs != nullptr) ecus[index].dtcs->clearDiagnostics();
+  }
+}
+
+uint16_t ECUNetwork::encodeDTCList(const VirtualECU& ecu, DTCState state, uint8_t* out) const {
+  uint16_t codes[MAX_DTCS_PER_RESPONSE];
+  uint16_t count = ecu.dtcs->list(state, codes, MAX_DTCS_PER_RESPONSE);
+
+  // CAN format: mode, DTC count, then two bytes per DTC
+  out[1] = count;
+  for (uint16_t i = 0; i < count; i++) {
+    out[2 + i * 2] = codes[i] >> 8;
+    out[3 + i * 2] = codes[i] & 0xFF;
+  }
+  return 2 + count * 2;
+}
+
+uint8_t ECUNetwork::encodeSupportedPIDs(const VirtualECU& ecu, uint8_t basePid, bool freezeFrame, uint8_t* out) const {
+  uint32_t bits = 0;
+  for (int i = 0; i < 32; i++) {
+    int pid = basePid + 1 + i;
+    bool supported = pid < 256 && ecu.supportsPID(pid);
+    // Mode 02 adds PID 02 (freeze frame DTC) and drops PID 01 (monitor status)
+    if (freezeFrame && pid == 0x02) supported = true;
+    if (freezeFrame && pid == 0x01) supported = false;
+    if (supported) bits |= 1UL << (31 - i);
+  }
+  out[0] = (bits >> 24) & 0xFF;
+  out[1] = (bits >> 16) & 0xFF;
+  out[2] = (bits >> 8) & 0xFF;
+  out[3] = bits & 0xFF;
+  return 4;
+}
+
+uint8_t ECUNetwork::encodeMode01(const VirtualECU& ecu, const SimulatedData& d, uint8_t pid, uint8_t* out) const {
+  if (!ecu.supportsPID(pid)) return 0;
+  if ((pid & 0x1F) == 0) return encodeSupportedPIDs(ecu, pid, false, out);
+
+  switch (pid) {
+    case 0x01: { // Monitor status: MIL + stored DTC count
+      uint32_t stored = ecu.dtcs != nullptr ? ecu.dtcs->count(DTC_STORED) : 0;
+      out[0] = (stored > 0 ? 0x80 : 0x00) | min(stored, (uint32_t)0x7F);
+      out[1] = 0x00;
+      out[2] = 0x00;
+      out[3] = 0x00;
+      return 4;
+    }
+    case 0x04: { // Engine load
+      out[0] = pidPercent(d.engineLoad);
+      return 1;
+    }
+    case 0x05: { // Engine coolant temperature
+      out[0] = pidTemperature(d.coolantTemp);
+      return 1;
+    }
+    case 0x0B: { // Intake manifold absolute pressure
+      out[0] = pidIntakePressure(d);
+      return 1;
+    }
+    case 0x0C: { // Engine RPM
+      uint16_t rpm = pidRpm(d);
+      out[0] = (rpm >> 8) & 0xFF;
+      out[1] = rpm & 0xFF;
+      return 2;
+    }
+    case 0x0D: { // Vehicle speed
+      out[0] = pidSpeed(d);
+      return 1;
+    }
+    case 0x0E: { // Timing advance
+      out[0] = 10 + 128; // 10 degrees + 128 offset
+      return 1;
+    }
+    case 0x0F: { // Intake air temperature
+      out[0] = pidTemperature(25); // Fixed 25°C
+      return 1;
+    }
+    case 0x10: { // Airflow rate
+      uint16_t airflow = pidAirflow(d);
+      out[0] = (airflow >> 8) & 0xFF;
+      out[1] = airflow & 0xFF;
+      return 2;
+    }
+    case 0x11: { // Throttle position
+      out[0] = pidPercent(d.throttlePos);
+      return 1;
+    }
+    case 0x2F: { // Fuel level
+      out[0] = pidPercent(d.fuelLevel);
+      return 1;
+    }
+    case 0x5C: { // Engine oil temperature
+      out[0] = pidTemperature(d.oilTemp);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+uint8_t ECUNetwork::encodeMode02(const VirtualECU& ecu, uint8_t pid, uint8_t frame, uint8_t* out) const {
+  // Only freeze frame 0 is stored; response is PID, frame number, data
+  if (frame != 0) return 0;
+  out[0] = frame;
+
+  if ((pid & 0x1F) == 0) {
+    if (pid != 0x00 && !ecu.supportsPID(pid)) return 0;
+    return 1 + encodeSupportedPIDs(ecu, pid, true, out + 1);
+  }
+
+  const FreezeFrame& ff = ecu.dtcs->freezeFrame();
+  if (pid == 0x02) {
+    // DTC that caused the freeze frame (0000 if none)
+    uint16_t code = ff.valid ? ff.dtc : 0;
+    out[1] = code >> 8;
+    out[2] = code & 0xFF;
+    return 3;
+  }
+  if (!ff.valid || pid == 0x01) return 0;
+
+  uint8_t len = encodeMode01(ecu, ff.data, pid, out + 1);
+  return len > 0 ? len + 1 : 0;
+}
+
+uint8_t ECUNetwork::encodeMode09(uint8_t pid, uint8_t* out) const {
+  if (pid == 0x00) {
+    // Supported Mode 09 PIDs: 02 (VIN)
+    out[0] = 0x40; out[1] = 0x00; out[2] = 0x00; out[3] = 0x00;
+    return 4;
+  }
+  if (pid == 0x02) {
+    // VIN: message count + characters
+    static const char vin[] = "1D4GP00B567589";
+    out[0] = 0x01;
+    memcpy(out + 1, vin, sizeof(vin) - 1);
+    return sizeof(vin);
+  }
+  return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef VIRTUAL_ECU_H
+#define VIRTUAL_ECU_H
+
+#include <Arduino.h>
+#include "SimulatedData.h"
+#include "DTCStore.h"
+
+// CAN addressing (ISO 15765-4, 11-bit)
+#define OBD_FUNCTIONAL_ID   0x7DF
+#define OBD_REQUEST_OFFSET  8      // physical request ID = response ID - 8
+#define CAN_ID_SPACE        0x800
+
+// Registry limits
+#define MAX_VIRTUAL_ECUS    64
+#define MAX_OBD_PAYLOAD     (2 + 2 * MAX_DTCS_PER_RESPONSE)
+
+// A single simulated control module on the virtual CAN bus
+struct VirtualECU {
+  const char* name = "";
+  uint16_t responseId = 0;
+  uint32_t mode01Pids[8] = {0};   // Bitmap of supported Mode 01 PIDs (bit n = PID n)
+  bool vehicleInfo = false;       // Answers Mode 09 (VIN etc.)
+  const SimulatedData* data = nullptr;
+  DTCStore* dtcs = nullptr;       // Answers Modes 02/03/04/07/0A when set
+
+  bool supportsPID(uint8_t pid) const { return mode01Pids[pid >> 5] & (1UL << (pid & 31)); }
+  uint16_t requestId() const { return responseId - OBD_REQUEST_OFFSET; }
+};
+
+// Registry of virtual ECUs with O(1) responder lookup per request
+class ECUNetwork {
+public:
+  ECUNetwork();
+
+  // Registration (returns ECU index, or -1 if full, ID in use or the request ID
+  // would collide with the functional 7DF address)
+  int addECU(const char* name, uint16_t responseId, const SimulatedData* data,
+             const uint8_t* pids, size_t pidCount, bool vehicleInfo = false,
+             DTCStore* dtcs = nullptr);
+  void clear();
+
+  // Bitmask of ECU indices that answer a request sent to the given header
+  uint64_t respondersFor(uint16_t header, uint8_t mode, uint8_t pid) const;
+
+  // Build the response payload (mode + 0x40, PID, data) for one ECU; returns length or 0.
+  // out must hold MAX_OBD_PAYLOAD bytes.
+  uint16_t encodeResponse(int index, uint8_t mode, uint8_t pid, uint8_t frame, uint8_t* out) const;
+
+  // Mode 04: clear stored/pending DTCs and freeze frames of the given ECUs
+  void clearDiagnostics(uint64_t responders);
+
+  // Accessors
+  int count() const { return ecuCount; }
+  const VirtualECU& ecu(int index) const { return ecus[index]; }
+
+private:
+  VirtualECU ecus[MAX_VIRTUAL_ECUS];
+  int ecuCount = 0;
+
+  // Lookup tables rebuilt on registration
+  uint64_t mode01Responders[256];
+  uint64_t mode09Responders = 0;
+  uint64_t dtcResponders = 0;
+  int8_t ecuByRequestId[CAN_ID_SPACE];
+
+  uint8_t encodeSupportedPIDs(const VirtualECU& ecu, uint8_t basePid, bool freezeFrame, uint8_t* out) const;
+  uint8_t encodeMode01(const VirtualECU& ecu, const SimulatedData& d, uint8_t pid, uint8_t* out) const;
+  uint8_t encodeMode02(const VirtualECU& ecu, uint8_t pid, uint8_t frame, uint8_t* out) const;
+  uint16_t encodeDTCList(const VirtualECU& ecu, DTCState state, uint8_t* out) const;
+  uint8_t encodeMode09(uint8_t pid, uint8_t* out) const;
+};
+
+#endif // VIRTUAL_ECU_H
@@ -29,9 +29,6 @@ void setup() {
 }
 
 void loop() {
-  // Run the simulator
+  // Run the simulator (blocks until a command, timer tick or status deadline)
   simulator.loop();
-  
-  // Small delay for stability
-  delay(10);
 }
\ No newline at end of file